@@ -26,6 +26,84 @@ kernel void test()
 
 #define USE_ATOMIC
 
+// must match sgm_cl::InputFormat
+#define INPUT_FORMAT_GRAY8 0
+#define INPUT_FORMAT_BGR8 1
+#define INPUT_FORMAT_BAYER_RGGB8 2
+#define INPUT_FORMAT_BAYER_BGGR8 3
+#define INPUT_FORMAT_BAYER_GRBG8 4
+#define INPUT_FORMAT_BAYER_GBRG8 5
+
+// remap entries are (x << 16 | y) in unsigned fixed point with REMAP_BITS fractional
+// bits, passed in by the host
+#ifndef REMAP_BITS
+#define REMAP_BITS 4
+#endif
+#define REMAP_SCALE (1 << REMAP_BITS)
+#define REMAP_INVALID 0xffffffff
+
+// gray value of raw source pixel (x, y), BT.601 weights in 8-bit fixed point
+inline int fetch_gray(global const uchar* src, int x, int y, int src_width, int src_height, int format)
+{
+	if (format == INPUT_FORMAT_GRAY8)
+		return src[y * src_width + x];
+
+	if (format == INPUT_FORMAT_BGR8) {
+		global const uchar* bgr = src + 3 * (y * src_width + x);
+		return (29 * bgr[0] + 150 * bgr[1] + 77 * bgr[2] + 128) >> 8;
+	}
+
+	// any 2x2 Bayer quad holds one R, two G and one B sample; the result belongs to
+	// the quad centre (x + 0.5, y + 0.5), rectify_kernel compensates for that
+	const int qx = min(x, src_width - 2);
+	const int qy = min(y, src_height - 2);
+	const int red_x = (format == INPUT_FORMAT_BAYER_BGGR8 || format == INPUT_FORMAT_BAYER_GRBG8) ? 1 : 0;
+	const int red_y = (format == INPUT_FORMAT_BAYER_BGGR8 || format == INPUT_FORMAT_BAYER_GBRG8) ? 1 : 0;
+	const int ox = (qx ^ red_x) & 1;
+	const int oy = (qy ^ red_y) & 1;
+
+	global const uchar* quad = src + qy * src_width + qx;
+	const int sum = quad[0] + quad[1] + quad[src_width] + quad[src_width + 1];
+	const int r = quad[oy * src_width + ox];
+	const int b = quad[(1 - oy) * src_width + (1 - ox)];
+	return (77 * r + 75 * (sum - r - b) + 29 * b + 128) >> 8;
+}
+
+// gray conversion and bilinear rectification of a raw frame into the 8-bit input of census_kernel
+kernel void rectify_kernel(global const uchar* d_raw, global const uint* d_map, global uchar* d_dest,
+	int width, int height, int src_width, int src_height, int format)
+{
+	const int j = get_global_id(0);
+	const int i = get_global_id(1);
+	if (j >= width || i >= height)
+		return;
+
+	const uint m = d_map[i * width + j];
+	if (m == REMAP_INVALID) {
+		d_dest[i * width + j] = 0;
+		return;
+	}
+
+	// Bayer gray values sit at quad centres, so sample half a pixel up-left of the
+	// map position; the top and left border rows replicate the first quad
+	const int shift = format >= INPUT_FORMAT_BAYER_RGGB8 ? REMAP_SCALE / 2 : 0;
+	const int fx = max((int)(m >> 16) - shift, 0);
+	const int fy = max((int)(m & 0xffff) - shift, 0);
+	const int x0 = fx >> REMAP_BITS;
+	const int y0 = fy >> REMAP_BITS;
+	const int x1 = min(x0 + 1, src_width - 1);
+	const int y1 = min(y0 + 1, src_height - 1);
+	const int ax = fx & (REMAP_SCALE - 1);
+	const int ay = fy & (REMAP_SCALE - 1);
+
+	const int top = fetch_gray(d_raw, x0, y0, src_width, src_height, format) * (REMAP_SCALE - ax)
+	              + fetch_gray(d_raw, x1, y0, src_width, src_height, format) * ax;
+	const int bottom = fetch_gray(d_raw, x0, y1, src_width, src_height, format) * (REMAP_SCALE - ax)
+	                 + fetch_gray(d_raw, x1, y1, src_width, src_height, format) * ax;
+	d_dest[i * width + j] = (top * (REMAP_SCALE - ay) + bottom * ay + (1 << (2 * REMAP_BITS - 1)))
+	                        >> (2 * REMAP_BITS);
+}
+
 kernel void census_kernel(global const uchar * d_source, global ulong* d_dest, int width, int height)
 {
 	const int i = get_global_id(1); //threadIdx.y + blockIdx.y * blockDim.y;
@@ -153,122 +231,73 @@ kernel void census_kernel(global const uchar * d_source, global ulong* d_dest, i
 }
 
 
-#define MCOST_LINES128 2
+#define MCOST_TILE_W 32
+#define MCOST_TILE_H 4
 #define DISP_SIZE 128
 #define PATHS_IN_BLOCK 8
+#define MCOST_RIGHT_W (MCOST_TILE_W + DISP_SIZE)
 
 #define PENALTY1 20
 #define PENALTY2 100
 #define v_PENALTY1 = (PENALTY1 << 16) | (PENALTY1 << 0);
 #define v_PENALTY2 = (PENALTY2 << 16) | (PENALTY2 << 0);
 
+/**
+ * Each work-group computes the costs of an MCOST_TILE_W x MCOST_TILE_H pixel tile.
+ * The left census of the tile and the right census it is matched against
+ * (up to DISP_SIZE pixels further left) are staged in local memory once, then
+ * each tile row -- MCOST_TILE_W * DISP_SIZE contiguous bytes of d_cost -- is
+ * written as uchar16 vectors by consecutive work-items.
+ * The layout is unchanged: d_cost[(y * width + x) * DISP_SIZE + d], as read by
+ * stereo_loop_128; right pixels left of the image border count as 0.
+ * The cost volume covers the width x height window at (x_offset, y_offset) of the
+ * frame_width wide census images, so window costs equal full frame ones.
+ */
 kernel void matching_cost_kernel_128(
 	global const uint64_t * d_left, global const uint64_t* d_right,
-	global uint8_t* d_cost, int width, int height)
+	global uchar16* d_cost, int width, int height,
+	int x_offset, int y_offset, int frame_width)
 {
-	int loc_x = get_local_id(0);
-	int loc_y = get_local_id(1);
-	int gr_x = get_group_id(0);
-	//int gr_y = get_group_id(1);
-
-	local uint64_t right_buf[(128 + 128) * MCOST_LINES128];
-	short y = gr_x * MCOST_LINES128 + loc_y;
-	short sh_offset = (128 + 128) * loc_y;
-	{ // first 128 pixel
-//#pragma unroll
-		//for (short t = 0; t < 128; t += 64) {		
-        if (y < height && loc_x < width)
-            right_buf[sh_offset + loc_x] = d_right[y * width + loc_x];
-        else
-            right_buf[sh_offset + loc_x] = 0;
-		//}
-
-		// local uint64_t left_warp_0[32]; 
-		// left_warp_0[loc_x] = d_left[y * width + loc_x];
-		// local uint64_t left_warp_32[32];
-		// left_warp_32[loc_x] = d_left[y * width + loc_x + 32];
-		// local uint64_t left_warp_64[32]; 
-		// left_warp_64[loc_x] = d_left[y * width + loc_x + 64];
-		// local uint64_t left_warp_96[32];
-		// left_warp_96[loc_x] = d_left[y * width + loc_x + 96];
-		// barrier(CLK_LOCAL_MEM_FENCE);
-
-		//barrier(CLK_LOCAL_MEM_FENCE);
-#pragma unroll
-		for (short x = 0; x < 128; x++) {
-            if (y < height && x < width)
-            {
-                uint64_t left_val = d_left[y * width + x];// left_warp_0[x];// shfl_u64(left_warp_0, x);
-    //#pragma unroll
-                //for (short k = loc_x; k < DISP_SIZE; k += 64) {
-				//loc_x is regarded as the disparity level.
-                uint64_t right_val = x < loc_x ? 0 : right_buf[sh_offset + x - loc_x];
-                int dst_idx = y * (width * DISP_SIZE) + x * DISP_SIZE + loc_x;
-                d_cost[dst_idx] = popcount(left_val ^ right_val);
-            }
-			//}
-		}
+	const int loc_x = get_local_id(0);
+	const int loc_y = get_local_id(1);
+	const int x0 = get_group_id(0) * MCOST_TILE_W;
+	const int y = get_group_id(1) * MCOST_TILE_H + loc_y;
+	const bool row_valid = y < height;
+
+	local uint64_t left_tile[MCOST_TILE_H][MCOST_TILE_W];
+	// right_tile[.][t] holds the right census at x0 - DISP_SIZE + t
+	local uint64_t right_tile[MCOST_TILE_H][MCOST_RIGHT_W];
+
+	global const uint64_t* left_row = d_left + (y + y_offset) * frame_width + x_offset;
+	global const uint64_t* right_row = d_right + (y + y_offset) * frame_width + x_offset;
+	{
+		const int x = x0 + loc_x;
+		left_tile[loc_y][loc_x] = (row_valid && x < width) ? left_row[x] : 0;
+	}
+	for (int t = loc_x; t < MCOST_RIGHT_W; t += MCOST_TILE_W) {
+		const int x = x0 - DISP_SIZE + t;
+		right_tile[loc_y][t] = (row_valid && x + x_offset >= 0 && x < width) ? right_row[x] : 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-//#pragma unroll
-//		for (short x = 32; x < 64; x++) {
-//            uint64_t left_val = d_left[y * width + x];// left_warp_32[x - 32];// shfl_u64(left_warp_32, x);
-//#pragma unroll
-//			for (short k = loc_x; k < DISP_SIZE; k += 32) {
-//				uint64_t right_val = x < k ? 0 : right_buf[sh_offset + x - k];
-//				int dst_idx = y * (width * DISP_SIZE) + x * DISP_SIZE + k;
-//				d_cost[dst_idx] = popcount(left_val ^ right_val);
-//			}
-//		}
-//
-//#pragma unroll
-//		for (short x = 64; x < 96; x++) {
-//            uint64_t left_val = d_left[y * width + x];// left_warp_64[x - 64];// shfl_u64(left_warp_64, x);
-//#pragma unroll
-//			for (short k = loc_x; k < DISP_SIZE; k += 32) {
-//				uint64_t right_val = x < k ? 0 : right_buf[sh_offset + x - k];
-//				int dst_idx = y * (width * DISP_SIZE) + x * DISP_SIZE + k;
-//				d_cost[dst_idx] = popcount(left_val ^ right_val);
-//			}
-//		}
-//
-//#pragma unroll
-//		for (short x = 96; x < 128; x++) {
-//			uint64_t left_val = d_left[y * width + x];// shfl_u64(left_warp_96, x);
-//#pragma unroll
-//			for (short k = loc_x; k < DISP_SIZE; k += 32) {
-//				uint64_t right_val = x < k ? 0 : right_buf[sh_offset + x - k];
-//				int dst_idx = y * (width * DISP_SIZE) + x * DISP_SIZE + k;
-//				d_cost[dst_idx] = popcount(left_val ^ right_val);
-//			}
-//		}
-	} // end first 128 pix
+	if (!row_valid)
+		return;
 
-	
-	for (short x = 128; x < width; x += 128) {
-        //if (y < height && x + loc_x < width)
-        {
-
-            //uint64_t left_warp = d_left[y * width + (x + loc_x)];
-            right_buf[sh_offset + loc_x + 128] = d_right[y * width + (x + loc_x)];
-			//barrier(CLK_LOCAL_MEM_FENCE);
-            for (short xoff = 0; xoff < 128; xoff++) {
-                if (y < height && x + xoff < width)
-                {
-                    uint64_t left_val = d_left[y * width + x + xoff];// 0;// shfl_u64(left_warp, xoff);
-        //#pragma unroll
-                    //for (short k = loc_x; k < DISP_SIZE; k += 64) {
-                    uint64_t right_val = right_buf[sh_offset + 128 + xoff - loc_x];
-                    int dst_idx = y * (width * DISP_SIZE) + (x + xoff) * DISP_SIZE + loc_x;
-                    d_cost[dst_idx] = popcount(left_val ^ right_val);
-                }
-                //}
-            }
-            //32 elso elemet kidobjuk
-            right_buf[sh_offset + loc_x + 0] = right_buf[sh_offset + loc_x + 128];
-            //right_buf[sh_offset + loc_x + 64] = right_buf[sh_offset + loc_x + 128];
-            //right_buf[sh_offset + loc_x + 128] = right_buf[sh_offset + loc_x + 96];
-            //right_buf[sh_offset + loc_x + 96] = right_buf[sh_offset + loc_x + 128];
-        }
+	const int vecs_per_pixel = DISP_SIZE / 16;
+	global uchar16* row_cost = d_cost + (y * width + x0) * vecs_per_pixel;
+	for (int v = loc_x; v < MCOST_TILE_W * vecs_per_pixel; v += MCOST_TILE_W) {
+		const int p = v / vecs_per_pixel;
+		const int d0 = (v % vecs_per_pixel) * 16;
+		if (x0 + p >= width)
+			break;
+
+		const uint64_t left_val = left_tile[loc_y][p];
+		local const uint64_t* right = &right_tile[loc_y][DISP_SIZE + p - d0];
+		uchar costs[16];
+#pragma unroll
+		for (int k = 0; k < 16; k++)
+			costs[k] = (uchar)popcount(left_val ^ right[-k]);
+		row_cost[v] = vload16(0, costs);
 	}
 }
 
@@ -310,25 +339,6 @@ inline int min_warp(local ushort * minCostNext)
 }
 
 
-inline int min_warp_int(local int * values)
-{
-	int local_index = get_local_id(0) + get_local_id(1) * 32;
-	barrier(CLK_LOCAL_MEM_FENCE);
-	for (int offset = 32 / 2;
-		offset > 0;
-		offset = offset / 2) {
-		if (get_local_id(0) < offset) {
-			int other = values[local_index + offset];
-			int mine = values[local_index];
-			values[local_index] = (mine < other) ? mine : other;
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
-	}
-
-	return  values[get_local_id(1) * 32];
-}
-
-
 inline int stereo_loop_128(
 	int i, int j, global const uchar4 *  d_matching_cost,
 	global uint16_t *d_scost, int width, int height, int minCost, local ushort2 *lcost_sh,
@@ -611,128 +621,144 @@ kernel void compute_stereo_oblique_dir_kernel_7(
 }
 
 
-#define WTA_PIXEL_IN_BLOCK 8
+#define WTA_TILE_W 64
+#define WTA_THREADS_PER_PIXEL 4
+#define WTA_DISP_PER_THREAD (DISP_SIZE / WTA_THREADS_PER_PIXEL)
+#define WTA_SPAN (WTA_TILE_W + DISP_SIZE - 1)
+
+#ifndef SUBPIXEL_SHIFT
+#define SUBPIXEL_SHIFT 4
+#endif
 
+// (best, second best) of 16 packed (cost << 16 | disparity) values
+inline uint2 best2_of_16(uint16 v)
+{
+	uint8 b8 = min(v.lo, v.hi);
+	uint8 s8 = max(v.lo, v.hi);
+	uint4 b4 = min(b8.lo, b8.hi);
+	uint4 s4 = min(max(b8.lo, b8.hi), min(s8.lo, s8.hi));
+	uint2 b2 = min(b4.lo, b4.hi);
+	uint2 s2 = min(max(b4.lo, b4.hi), min(s4.lo, s4.hi));
+	return (uint2)(min(b2.x, b2.y), min(max(b2.x, b2.y), min(s2.x, s2.y)));
+}
+
+inline uint2 merge_best2(uint2 a, uint2 b)
+{
+	return (uint2)(min(a.x, b.x), min(max(a.x, b.x), min(a.y, b.y)));
+}
 
-kernel void winner_takes_all_kernel128(global ushort * leftDisp, global ushort * rightDisp, global const ushort * d_cost, int width, int height)
+// uniqueness check, then optional parabola fit; neighbours holds the costs at
+// the best disparity - 1 and + 1, or -1 where they do not exist
+inline ushort wta_output(uint best, uint second, int2 neighbours, int subpixel)
 {
 	const float uniqueness = 0.95f;
 
-	int idx = get_local_id(0);
-	int x = get_group_id(0) * WTA_PIXEL_IN_BLOCK + get_local_id(1);
-	int y = get_group_id(1);
+	if (best == UINT_MAX)
+		return 0;
+	const int min_disp = best & 0xffff;
+	const int min_cost = best >> 16;
+	const int min_disp2 = second == UINT_MAX ? -1 : (int)(second & 0xffff);
+	const int min_cost2 = second >> 16;
+	if (min_cost2 * uniqueness < min_cost && abs(min_disp - min_disp2) > 1)
+		return 0;
+	if (!subpixel)
+		return min_disp + 1; // add "+1"
+
+	int frac = 0;
+	if (neighbours.x >= 0 && neighbours.y >= 0) {
+		const int denom = neighbours.x - 2 * min_cost + neighbours.y;
+		if (denom > 0)
+			frac = ((neighbours.x - neighbours.y) << SUBPIXEL_SHIFT) / (2 * denom);
+	}
+	return ((min_disp + 1) << SUBPIXEL_SHIFT) + frac;
+}
 
-	const unsigned cost_offset = DISP_SIZE * (y * width + x);
-	global const ushort* current_cost = d_cost + cost_offset;
-	
-	local ushort tmp_costs_block[DISP_SIZE * WTA_PIXEL_IN_BLOCK];
-	local ushort * tmp_costs = tmp_costs_block + DISP_SIZE * get_local_id(1);
-
-	uint32_t tmp_cL1, tmp_cL2; uint32_t tmp_cL3, tmp_cL4;
-	uint32_t tmp_cR1, tmp_cR2; uint32_t tmp_cR3, tmp_cR4;
-
-	// right (1)
-	const int idx_1 = idx * 4 + 0;
-	const int idx_2 = idx * 4 + 1;
-	const int idx_3 = idx * 4 + 2;
-	const int idx_4 = idx * 4 + 3;
-
-	// TODO optimize global memory loads
-	tmp_costs[idx_1] = ((x + (idx_1)) >= width) ? 0xffff : d_cost[DISP_SIZE * (y * width + (x + idx_1)) + idx_1]; // d_cost[y][x + idx0][idx0]
-	tmp_costs[idx_2] = ((x + (idx_2)) >= width) ? 0xffff : d_cost[DISP_SIZE * (y * width + (x + idx_2)) + idx_2];
-	tmp_costs[idx_3] = ((x + (idx_3)) >= width) ? 0xffff : d_cost[DISP_SIZE * (y * width + (x + idx_3)) + idx_3];
-	tmp_costs[idx_4] = ((x + (idx_4)) >= width) ? 0xffff : d_cost[DISP_SIZE * (y * width + (x + idx_4)) + idx_4];
-
-	//tmp_costs[idx_1] = d_cost[DISP_SIZE * (y * width + (x + idx_1)) + idx_1]; // d_cost[y][x + idx0][idx0]
-
-
-	ushort4 tmp_vcL1 = vload4(0, current_cost + idx_1);
-	//const uint2 idx_v = make_uint2((idx_2 << 16) | idx_1, (idx_4 << 16) | idx_3);
-	//ushort4 idx_v = (ushort4)(idx_1, idx_2 , idx_3, idx_4);
-
-	tmp_cR1 = tmp_costs[idx_1];
-	tmp_cR2 = tmp_costs[idx_2];
-	tmp_cR3 = tmp_costs[idx_3];
-	tmp_cR4 = tmp_costs[idx_4];
-
-	tmp_cL1 = (tmp_vcL1.x << 16) + idx_1;// __byte_perm(idx_v.x, tmp_vcL1.x, 0x5410);
-	tmp_cL2 = (tmp_vcL1.y << 16) + idx_2;//__byte_perm(idx_v.x, tmp_vcL1.x, 0x7632);
-	tmp_cL3 = (tmp_vcL1.z << 16) + idx_3; //__byte_perm(idx_v.y, tmp_vcL1.y, 0x5410);
-	tmp_cL4 = (tmp_vcL1.w << 16) + idx_4; //__byte_perm(idx_v.y, tmp_vcL1.y, 0x7632);
-
-	tmp_cR1 = (tmp_cR1 << 16) + idx_1;
-	tmp_cR2 = (tmp_cR2 << 16) + idx_2;
-	tmp_cR3 = (tmp_cR3 << 16) + idx_3;
-	tmp_cR4 = (tmp_cR4 << 16) + idx_4;
-	//////////////////////////////////////
-
-	local int valL1[32 * WTA_PIXEL_IN_BLOCK];
-
-	valL1[idx + get_local_id(1) * 32] = min(min(tmp_cL1, tmp_cL2), min(tmp_cL3, tmp_cL4));
-	int minTempL1 = min_warp_int(valL1);
-
-	int minCostL1 = (minTempL1 >> 16);
-	int minDispL1 = minTempL1 & 0xffff;
-	//////////////////////////////////////
-	if (idx_1 == minDispL1) { tmp_cL1 = 0x7fffffff; }
-	if (idx_2 == minDispL1) { tmp_cL2 = 0x7fffffff; }
-	if (idx_3 == minDispL1) { tmp_cL3 = 0x7fffffff; }
-	if (idx_4 == minDispL1) { tmp_cL4 = 0x7fffffff; }
-
-	valL1[idx + get_local_id(1) * 32] = min(min(tmp_cL1, tmp_cL2), min(tmp_cL3, tmp_cL4));
-	int minTempL2 = min_warp_int(valL1);
-	int minCostL2 = (minTempL2 >> 16);
-	int minDispL2 = minTempL2 & 0xffff;
-	minDispL2 = minDispL2 == 0xffff ? -1 : minDispL2;
-	//////////////////////////////////////
-
-	if (idx_1 + x >= width) { tmp_cR1 = 0x7fffffff; }
-	if (idx_2 + x >= width) { tmp_cR2 = 0x7fffffff; }
-	if (idx_3 + x >= width) { tmp_cR3 = 0x7fffffff; }
-	if (idx_4 + x >= width) { tmp_cR4 = 0x7fffffff; }
-
-	valL1[idx + get_local_id(1) * 32] = min(min(tmp_cR1, tmp_cR2), min(tmp_cR3, tmp_cR4));
-	int minTempR1 = min_warp_int(valL1);
-
-	int minCostR1 = (minTempR1 >> 16);
-	int minDispR1 = minTempR1 & 0xffff;
-	if (minDispR1 == 0xffff) { minDispR1 = -1; }
-	///////////////////////////////////////////////////////////////////////////////////
-	// right (2)
-	tmp_costs[idx_1] = ((idx_1) == minDispR1 || (x + (idx_1)) >= width) ? 0xffff : tmp_costs[idx_1];
-	tmp_costs[idx_2] = ((idx_2) == minDispR1 || (x + (idx_2)) >= width) ? 0xffff : tmp_costs[idx_2];
-	tmp_costs[idx_3] = ((idx_3) == minDispR1 || (x + (idx_3)) >= width) ? 0xffff : tmp_costs[idx_3];
-	tmp_costs[idx_4] = ((idx_4) == minDispR1 || (x + (idx_4)) >= width) ? 0xffff : tmp_costs[idx_4];
-
-	tmp_cR1 = tmp_costs[idx_1];
-	tmp_cR1 = (tmp_cR1 << 16) + idx_1;
-
-	tmp_cR2 = tmp_costs[idx_2];
-	tmp_cR2 = (tmp_cR2 << 16) + idx_2;
-
-	tmp_cR3 = tmp_costs[idx_3];
-	tmp_cR3 = (tmp_cR3 << 16) + idx_3;
-
-	tmp_cR4 = tmp_costs[idx_4];
-	tmp_cR4 = (tmp_cR4 << 16) + idx_4;
-
-	if (idx_1 + x >= width || idx_1 == minDispR1) { tmp_cR1 = 0x7fffffff; }
-	if (idx_2 + x >= width || idx_2 == minDispR1) { tmp_cR2 = 0x7fffffff; }
-	if (idx_3 + x >= width || idx_3 == minDispR1) { tmp_cR3 = 0x7fffffff; }
-	if (idx_4 + x >= width || idx_4 == minDispR1) { tmp_cR4 = 0x7fffffff; }
-
-	valL1[idx + get_local_id(1) * 32] = min(min(tmp_cR1, tmp_cR2), min(tmp_cR3, tmp_cR4));
-	int minTempR2 = min_warp_int(valL1);
-	int minCostR2 = (minTempR2 >> 16);
-	int minDispR2 = minTempR2 & 0xffff;
-	if (minDispR2 == 0xffff) { minDispR2 = -1; }
-	///////////////////////////////////////////////////////////////////////////////////
-
-	if (idx == 0) {
-		float lhv = minCostL2 * uniqueness;
-		leftDisp[y * width + x] = (lhv < minCostL1 && abs(minDispL1 - minDispL2) > 1) ? 0 : minDispL1 + 1; // add "+1" 
-		float rhv = minCostR2 * uniqueness;
-		rightDisp[y * width + x] = (rhv < minCostR1 && abs(minDispR1 - minDispR2) > 1) ? 0 : minDispR1 + 1; // add "+1" 
+/**
+ * A work-group handles WTA_TILE_W pixels of one row, WTA_THREADS_PER_PIXEL work-items
+ * per pixel. The row span the tile needs, including the DISP_SIZE - 1 pixels to its
+ * right searched by the right disparity, is streamed once with contiguous loads into
+ * right_costs, which keeps the diagonal d_cost[y][x + d][d] of each right pixel x.
+ * A pixel's own left cost vector is contiguous, so its work-items read it straight
+ * from global memory. Both minima come from vector (best, second best) reductions
+ * plus a 2-step merge across the pixel's work-items. With subpixel != 0 the outputs
+ * are fixed point with SUBPIXEL_SHIFT fractional bits.
+ * d_cost covers a width x height window at (x_offset, y_offset) of the frame_width
+ * wide disparity maps; only window columns [roi_x, roi_x + roi_width) of the rows
+ * starting at roi_y, one per group row, are evaluated and written.
+ */
+kernel void winner_takes_all_kernel128(global ushort * leftDisp, global ushort * rightDisp,
+	global const ushort * d_cost, int width, int height, int subpixel,
+	int roi_x, int roi_y, int roi_width, int x_offset, int y_offset, int frame_width)
+{
+	const int lane = get_local_id(0);
+	const int px = get_local_id(1);
+	const int lid = lane + px * WTA_THREADS_PER_PIXEL;
+	const int x0 = roi_x + get_group_id(0) * WTA_TILE_W;
+	const int y = roi_y + get_group_id(1);
+
+	local ushort right_costs[WTA_TILE_W * DISP_SIZE];
+	local uint4 best2[WTA_TILE_W * WTA_THREADS_PER_PIXEL];
+
+	global const ushort* row_cost = d_cost + DISP_SIZE * (y * width + x0);
+	const int span = min(WTA_SPAN, width - x0);
+	for (int c = lid; c < span * (DISP_SIZE / 8); c += WTA_TILE_W * WTA_THREADS_PER_PIXEL) {
+		const int p = c / (DISP_SIZE / 8);
+		const int d0 = (c % (DISP_SIZE / 8)) * 8;
+		ushort tmp[8];
+		vstore8(vload8(c, row_cost), 0, tmp);
+#pragma unroll
+		for (int k = 0; k < 8; k++) {
+			const int xr = p - (d0 + k);
+			if (xr >= 0 && xr < WTA_TILE_W)
+				right_costs[DISP_SIZE * xr + d0 + k] = tmp[k];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	const int x = x0 + px;
+	const int d_base = lane * WTA_DISP_PER_THREAD;
+	global const ushort* own_costs = row_cost + DISP_SIZE * px;
+	local const ushort* diag_costs = right_costs + DISP_SIZE * px;
+
+	uint2 best_l = (uint2)(UINT_MAX);
+	uint2 best_r = (uint2)(UINT_MAX);
+#pragma unroll
+	for (int d = d_base; d < d_base + WTA_DISP_PER_THREAD; d += 16) {
+		const uint16 disp_idx = (uint16)(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15) + (uint)d;
+		if (x < width) {
+			uint16 packed_l = (convert_uint16(vload16(0, own_costs + d)) << 16) | disp_idx;
+			best_l = merge_best2(best_l, best2_of_16(packed_l));
+		}
+		uint16 packed_r = (convert_uint16(vload16(0, diag_costs + d)) << 16) | disp_idx;
+		// right pixel x only has costs for x + d < width
+		packed_r = select(packed_r, (uint16)(UINT_MAX), convert_int16(disp_idx) + x >= width);
+		best_r = merge_best2(best_r, best2_of_16(packed_r));
+	}
+
+	best2[lid] = (uint4)(best_l, best_r);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int offset = WTA_THREADS_PER_PIXEL / 2; offset > 0; offset = offset / 2) {
+		if (lane < offset) {
+			uint4 a = best2[lid];
+			uint4 b = best2[lid + offset];
+			best2[lid] = (uint4)(merge_best2(a.xy, b.xy), merge_best2(a.zw, b.zw));
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lane == 0 && x < roi_x + roi_width) {
+		const uint4 r = best2[lid];
+		const int out_idx = (y + y_offset) * frame_width + x + x_offset;
+		const int dl = r.x & 0xffff;
+		const int dr = r.z & 0xffff;
+		int2 neighbours_l = (int2)(-1);
+		int2 neighbours_r = (int2)(-1);
+		if (subpixel && dl > 0 && dl + 1 < DISP_SIZE)
+			neighbours_l = (int2)((int)own_costs[dl - 1], (int)own_costs[dl + 1]);
+		if (subpixel && dr > 0 && dr + 1 < min(DISP_SIZE, width - x))
+			neighbours_r = (int2)((int)diag_costs[dr - 1], (int)diag_costs[dr + 1]);
+		leftDisp[out_idx] = wta_output(r.x, r.y, neighbours_l, subpixel);
+		rightDisp[out_idx] = wta_output(r.z, r.w, neighbours_r, subpixel);
 	}
 }
 
@@ -756,6 +782,19 @@ kernel void check_consistency_kernel_left(
 }
 
 
+// zeroes disparities outside the region of interest mask
+kernel void mask_disparity(global ushort* d_disp, global const uchar* d_mask, int width, int height)
+{
+	const int j = get_global_id(0);
+	const int i = get_global_id(1);
+	if (j >= width || i >= height)
+		return;
+
+	if (d_mask[i * width + j] == 0)
+		d_disp[i * width + j] = 0;
+}
+
+
 // clamp condition
 inline int clampBC(const int x, const int y, const int nx, const int ny)
 {
@@ -894,9 +933,10 @@ kernel void copy_u8_to_u16(global const uchar * input,
 	output[x] = input[x];
 }
 //float8 is of vector type
-kernel void clear_buffer(global float8 * buff)
+kernel void clear_buffer(global float8 * buff, int count)
 {
 	int x = get_global_id(0);
-	buff[x] = (float8)0;
+	if (x < count)
+		buff[x] = (float8)0;
 }
 
@@ -32,6 +32,73 @@ static int GetCLMemFlag(MemFlag mem_flag)
     return ret;
 }
 
+// packs per pixel source coordinates into (x << 16 | y) with REMAP_BITS fractional
+// bits, as read by rectify_kernel (REMAP_BITS is passed to the program build);
+// out of source samples become REMAP_INVALID
+static const int REMAP_BITS = 4;
+static const uint32_t REMAP_INVALID = 0xffffffff;
+
+static std::vector<uint32_t> PackRemap(const float* map_x, const float* map_y, int width,
+                                       int height, int src_width, int src_height)
+{
+    std::vector<uint32_t> packed(size_t(width) * height);
+    for(int i = 0; i < height; i++){
+        for(int j = 0; j < width; j++){
+            size_t idx = size_t(i) * width + j;
+            float x = map_x ? map_x[idx] : float(j);
+            float y = map_y ? map_y[idx] : float(i);
+            if(!(x >= 0.f && y >= 0.f && x <= src_width - 1 && y <= src_height - 1)){
+                packed[idx] = REMAP_INVALID;
+                continue;
+            }
+            uint32_t fx = uint32_t(x * (1 << REMAP_BITS) + 0.5f);
+            uint32_t fy = uint32_t(y * (1 << REMAP_BITS) + 0.5f);
+            packed[idx] = (fx << 16) | fy;
+        }
+    }
+    return packed;
+}
+
+static Rect Intersect(const Rect& a, const Rect& b)
+{
+    int x0 = std::max(a.x, b.x), y0 = std::max(a.y, b.y);
+    int x1 = std::min(a.x + a.width, b.x + b.width);
+    int y1 = std::min(a.y + a.height, b.y + b.height);
+    return Rect(x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0));
+}
+
+static size_t Area(const Rect& r)
+{
+    return size_t(r.width) * r.height;
+}
+
+static Rect Union(const Rect& a, const Rect& b)
+{
+    int x0 = std::min(a.x, b.x), y0 = std::min(a.y, b.y);
+    int x1 = std::max(a.x + a.width, b.x + b.width);
+    int y1 = std::max(a.y + a.height, b.y + b.height);
+    return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// grows a window inside the frame until its size is a multiple of align, which
+// the aggregation kernels need (they launch one work-group per `align` paths)
+static Rect AlignWindow(const Rect& r, int width, int height, int align)
+{
+    Rect out = r;
+    int pad_x = (align - out.width % align) % align;
+    int right = std::min(pad_x, width - (out.x + out.width));
+    out.width += right;
+    out.x -= std::min(pad_x - right, out.x);
+    out.width = std::min(width, out.width + (r.x - out.x));
+
+    int pad_y = (align - out.height % align) % align;
+    int bottom = std::min(pad_y, height - (out.y + out.height));
+    out.height += bottom;
+    out.y -= std::min(pad_y - bottom, out.y);
+    out.height = std::min(height, out.height + (r.y - out.y));
+    return out;
+}
+
 /**
  * definitions for members of CLContext
  */
@@ -324,7 +391,9 @@ void CLBuffer::Read(void *data, size_t offset, size_t size, SyncMode block_queue
  * definitions for members of StereoSGMCL
  */
 StereoSGMCL::StereoSGMCL(int width, int height, int disp_size, const CLContext* ctx):
-           width_(width), height_(height), disp_size_(disp_size), context_(nullptr){
+           width_(width), height_(height), disp_size_(disp_size), subpixel_(false),
+           preprocess_(false), input_format_(INPUT_FORMAT_GRAY8), src_width_(width),
+           src_height_(height), cost_capacity_(0), masked_(false), context_(nullptr){
     Init(ctx);
 }
 
@@ -341,6 +410,11 @@ StereoSGMCL::~StereoSGMCL(){
     delete d_right_disparity;
     delete d_tmp_left_disp;
     delete d_tmp_right_disp;
+    delete d_raw_left;
+    delete d_raw_right;
+    delete d_map_left;
+    delete d_map_right;
+    delete d_mask;
 }
 
 bool StereoSGMCL::Init(const CLContext *ctx) {
@@ -348,7 +422,11 @@ bool StereoSGMCL::Init(const CLContext *ctx) {
         return false;
     context_ = ctx;
     //initialize kernels
-    sgm_prog_ = new CLProgram(SGM_SRC_PATH, context_);
+    sgm_prog_ = new CLProgram(SGM_SRC_PATH, context_, "-I \"./\" -D SUBPIXEL_SHIFT="
+                                                      + std::to_string(SUBPIXEL_SHIFT)
+                                                      + " -D REMAP_BITS="
+                                                      + std::to_string(REMAP_BITS));
+    m_rectify_kernel = sgm_prog_->GetKernel("rectify_kernel");
     m_census_kernel = sgm_prog_->GetKernel("census_kernel");
     m_matching_cost_kernel_128 = sgm_prog_->GetKernel("matching_cost_kernel_128");
     m_compute_stereo_horizontal_dir_kernel_0 = sgm_prog_->GetKernel("compute_stereo_horizontal_dir_kernel_0");
@@ -362,6 +440,7 @@ bool StereoSGMCL::Init(const CLContext *ctx) {
     m_winner_takes_all_kernel128 = sgm_prog_->GetKernel("winner_takes_all_kernel128");
     m_check_consistency_left = sgm_prog_->GetKernel("check_consistency_kernel_left");
     m_median_3x3 = sgm_prog_->GetKernel("median3x3");
+    m_mask_disparity = sgm_prog_->GetKernel("mask_disparity");
     m_copy_u8_to_u16 = sgm_prog_->GetKernel("copy_u8_to_u16");
     m_clear_buffer = sgm_prog_->GetKernel("clear_buffer");
 
@@ -376,19 +455,15 @@ bool StereoSGMCL::Init(const CLContext *ctx) {
     d_right_disparity = new CLBuffer(context_,sizeof(uint16_t) * width_ * height_);
     d_tmp_left_disp = new CLBuffer(context_,sizeof(uint16_t) * width_ * height_);
     d_tmp_right_disp = new CLBuffer(context_,sizeof(uint16_t) * width_ * height_);
+    //preprocessing buffers are created by SetPreprocess
+    d_raw_left = d_raw_right = d_map_left = d_map_right = nullptr;
+    d_mask = nullptr;
+    cost_capacity_ = size_t(width_) * height_;
+    windows_.assign(1, make_window(std::vector<Rect>(1, Rect(0, 0, width_, height_)), 0));
 
     //setup kernels
     m_census_kernel->SetArgs(d_src_left, d_left, width_, height_);
-    m_matching_cost_kernel_128->SetArgs(d_left, d_right, d_matching_cost, width_, height_);
-    m_compute_stereo_horizontal_dir_kernel_0->SetArgs(d_matching_cost, d_scost, width_, height_);
-    m_compute_stereo_horizontal_dir_kernel_4->SetArgs(d_matching_cost, d_scost, width_, height_);
-    m_compute_stereo_vertical_dir_kernel_2->SetArgs(d_matching_cost, d_scost, width_, height_);
-    m_compute_stereo_vertical_dir_kernel_6->SetArgs(d_matching_cost, d_scost, width_, height_);
-    m_compute_stereo_oblique_dir_kernel_1->SetArgs(d_matching_cost, d_scost, width_, height_);
-    m_compute_stereo_oblique_dir_kernel_3->SetArgs(d_matching_cost, d_scost, width_, height_);
-    m_compute_stereo_oblique_dir_kernel_5->SetArgs(d_matching_cost, d_scost, width_, height_);
-    m_compute_stereo_oblique_dir_kernel_7->SetArgs(d_matching_cost, d_scost, width_, height_);
-    m_winner_takes_all_kernel128->SetArgs(d_left_disparity, d_right_disparity, d_scost, width_, height_);
+    //cost volume and aggregation kernels are set up per window, see Run
     m_check_consistency_left->SetArgs(d_tmp_left_disp, d_tmp_right_disp, d_src_left, width_, height_);
     m_median_3x3->SetArgs(d_left_disparity, d_tmp_left_disp, width_, height_);
     m_copy_u8_to_u16->SetArgs(d_matching_cost, d_scost);
@@ -396,19 +471,227 @@ bool StereoSGMCL::Init(const CLContext *ctx) {
     return true;
 }
 
+bool StereoSGMCL::SetPreprocess(InputFormat format, int src_width, int src_height,
+                                const float* map_x_left, const float* map_y_left,
+                                const float* map_x_right, const float* map_y_right){
+    const int max_src_size = 1 << (16 - REMAP_BITS);
+    bool is_bayer = format >= INPUT_FORMAT_BAYER_RGGB8 && format <= INPUT_FORMAT_BAYER_GBRG8;
+    if(src_width <= int(is_bayer) || src_height <= int(is_bayer) ||
+       src_width > max_src_size || src_height > max_src_size){
+        printf("Unsupported preprocessing source size %dx%d!\n", src_width, src_height);
+        return false;
+    }
+    if((map_x_left == nullptr) != (map_y_left == nullptr) ||
+       (map_x_right == nullptr) != (map_y_right == nullptr)){
+        printf("Rectification maps need both x and y components!\n");
+        return false;
+    }
+
+    input_format_ = format;
+    src_width_ = src_width;
+    src_height_ = src_height;
+
+    //gray frames at frame size without maps need no preprocessing, Run() then takes
+    //them directly again
+    if(format == INPUT_FORMAT_GRAY8 && src_width == width_ && src_height == height_ &&
+       !map_x_left && !map_x_right){
+        delete d_raw_left;
+        delete d_raw_right;
+        delete d_map_left;
+        delete d_map_right;
+        d_raw_left = d_raw_right = d_map_left = d_map_right = nullptr;
+        preprocess_ = false;
+        return true;
+    }
+
+    size_t raw_size = size_t(src_width_) * src_height_ * (format == INPUT_FORMAT_BGR8 ? 3 : 1);
+
+    delete d_raw_left;
+    delete d_raw_right;
+    d_raw_left = new CLBuffer(context_, raw_size, MEM_FLAG_READ_ONLY);
+    d_raw_right = new CLBuffer(context_, raw_size, MEM_FLAG_READ_ONLY);
+
+    std::vector<uint32_t> map_left = PackRemap(map_x_left, map_y_left, width_, height_,
+                                               src_width_, src_height_);
+    std::vector<uint32_t> map_right = PackRemap(map_x_right, map_y_right, width_, height_,
+                                                src_width_, src_height_);
+    delete d_map_left;
+    delete d_map_right;
+    d_map_left = new CLBuffer(context_, sizeof(uint32_t) * width_ * height_,
+                              MEM_FLAG_READ_ONLY, map_left.data());
+    d_map_right = new CLBuffer(context_, sizeof(uint32_t) * width_ * height_,
+                               MEM_FLAG_READ_ONLY, map_right.data());
+    preprocess_ = true;
+    return true;
+}
+
+bool StereoSGMCL::SetROIs(const std::vector<Rect>& rois, int margin){
+    if(margin < 0){
+        printf("Invalid ROI margin %d!\n", margin);
+        return false;
+    }
+    masked_ = false;
+    const Rect frame(0, 0, width_, height_);
+    if(rois.empty()){
+        set_windows(std::vector<Window>(1, make_window(std::vector<Rect>(1, frame), 0)));
+        return true;
+    }
+
+    std::vector<Window> windows;
+    for(const Rect& r : rois){
+        Rect roi = Intersect(r, frame);
+        if(roi.width > 0 && roi.height > 0)
+            windows.push_back(make_window(std::vector<Rect>(1, roi), margin));
+    }
+
+    //merge windows only where one window costs no more than the two separate ones,
+    //overlapping margins are then aggregated once instead of twice
+    bool merged = true;
+    while(merged){
+        merged = false;
+        for(size_t i = 0; i < windows.size() && !merged; i++){
+            for(size_t j = i + 1; j < windows.size() && !merged; j++){
+                std::vector<Rect> joined = windows[i].rois;
+                joined.insert(joined.end(), windows[j].rois.begin(), windows[j].rois.end());
+                Window candidate = make_window(joined, margin);
+                if(Area(candidate.area) <= Area(windows[i].area) + Area(windows[j].area)){
+                    windows[i] = candidate;
+                    windows.erase(windows.begin() + j);
+                    merged = true;
+                }
+            }
+        }
+    }
+    set_windows(windows);
+    return true;
+}
+
+bool StereoSGMCL::SetMask(const uint8_t* mask, int margin){
+    if(margin < 0){
+        printf("Invalid ROI margin %d!\n", margin);
+        return false;
+    }
+    if(!mask)
+        return SetROIs(std::vector<Rect>());
+
+    const int MASK_BAND_ROWS = 16;
+    std::vector<Rect> bands;
+    for(int y0 = 0; y0 < height_; y0 += MASK_BAND_ROWS){
+        int y1 = std::min(height_, y0 + MASK_BAND_ROWS);
+        int x_min = width_, x_max = -1;
+        for(int y = y0; y < y1; y++){
+            const uint8_t* row = mask + size_t(y) * width_;
+            for(int x = 0; x < width_; x++){
+                if(row[x]){
+                    x_min = std::min(x_min, x);
+                    x_max = std::max(x_max, x);
+                }
+            }
+        }
+        if(x_max >= 0)
+            bands.push_back(Rect(x_min, y0, x_max - x_min + 1, y1 - y0));
+    }
+
+    //split the bands into runs of consecutive bands, one window per run, so that the
+    //summed window area is minimal: best[j] is the cheapest cover of bands [0, j)
+    const size_t num_bands = bands.size();
+    std::vector<size_t> best(num_bands + 1, 0), run_start(num_bands + 1, 0);
+    for(size_t j = 1; j <= num_bands; j++){
+        best[j] = size_t(-1);
+        Rect bounds = bands[j - 1];
+        for(size_t i = j; i-- > 0;){
+            bounds = Union(bounds, bands[i]);
+            size_t cost = best[i] + Area(make_window(std::vector<Rect>(1, bounds), margin).area);
+            if(cost < best[j]){
+                best[j] = cost;
+                run_start[j] = i;
+            }
+        }
+    }
+    std::vector<Window> windows;
+    for(size_t j = num_bands; j > 0; j = run_start[j]){
+        std::vector<Rect> run(bands.begin() + run_start[j], bands.begin() + j);
+        windows.push_back(make_window(run, margin));
+    }
+
+    if(!d_mask)
+        d_mask = new CLBuffer(context_, width_ * height_, MEM_FLAG_READ_ONLY);
+    d_mask->Write(mask);
+    masked_ = true;
+    set_windows(windows);
+    return true;
+}
+
+StereoSGMCL::Window StereoSGMCL::make_window(const std::vector<Rect>& rois, int margin) const{
+    static const int PATHS_IN_BLOCK = 8;
+    const Rect frame(0, 0, width_, height_);
+    Rect bounds = rois.front();
+    for(const Rect& roi : rois)
+        bounds = Union(bounds, roi);
+    Rect area = Intersect(Rect(bounds.x - margin, bounds.y - margin, bounds.width + 2 * margin,
+                               bounds.height + 2 * margin), frame);
+    return Window{AlignWindow(area, width_, height_, PATHS_IN_BLOCK), rois};
+}
+
+void StereoSGMCL::set_windows(const std::vector<Window>& windows){
+    size_t max_pixels = 0;
+    for(const Window& window : windows)
+        max_pixels = std::max(max_pixels, Area(window.area));
+    windows_ = windows;
+    reserve_cost_volume(max_pixels);
+}
+
+void StereoSGMCL::reserve_cost_volume(size_t num_pixels){
+    //keep the buffers unless they are too small or mostly unused
+    if(num_pixels == 0 || (num_pixels <= cost_capacity_ && num_pixels * 2 > cost_capacity_))
+        return;
+    delete d_matching_cost;
+    delete d_scost;
+    d_matching_cost = new CLBuffer(context_, num_pixels * disp_size_);
+    d_scost = new CLBuffer(context_, sizeof(uint16_t) * num_pixels * disp_size_);
+    m_copy_u8_to_u16->SetArgs(d_matching_cost, d_scost);
+    cost_capacity_ = num_pixels;
+}
+
 void StereoSGMCL::Run(void *left_img, void *right_img, void *output){
-    d_src_left->Write(left_img);
-    d_src_right->Write(right_img);
+    if(preprocess_){
+        d_raw_left->Write(left_img);
+        d_raw_right->Write(right_img);
+        rectify();
+    }else{
+        d_src_left->Write(left_img);
+        d_src_right->Write(right_img);
+    }
     census();
     mem_init();
-    matching_cost();
-    scan_cost();
-    winner_takes_all();
+    for(const Window& window : windows_){
+        matching_cost(window);
+        scan_cost(window);
+        winner_takes_all(window);
+        //the next window reuses the cost volume
+        if(windows_.size() > 1)
+            context_->Finish(0);
+    }
     median();
+    if(masked_)
+        apply_mask();
     context_->Finish(0);
     d_tmp_left_disp->Read(output);
 }
 
+void StereoSGMCL::rectify(){
+    int format = input_format_;
+    m_rectify_kernel->SetArgs(d_raw_left, d_map_left, d_src_left, width_, height_,
+                              src_width_, src_height_, format);
+    m_rectify_kernel->Launch(0, GridDim((width_ + 16 - 1)/16, (height_ + 16 - 1)/16),
+                                                                   BlockDim(16,16));
+    context_->Finish(0);
+    m_rectify_kernel->SetArgs(d_raw_right, d_map_right, d_src_right);
+    m_rectify_kernel->Launch(0, GridDim((width_ + 16 - 1)/16, (height_ + 16 - 1)/16),
+                                                                   BlockDim(16,16));
+    context_->Finish(0);
+}
+
 void StereoSGMCL::census(){
     m_census_kernel->SetArgs(d_src_left, d_left);
     m_census_kernel->Launch(0, GridDim((width_ + 16 - 1)/16, (height_ + 16 - 1)/16),
@@ -420,34 +703,51 @@ void StereoSGMCL::census(){
     context_->Finish(0);
 }
 
+//clears size bytes, sizes are multiples of the 32 bytes of a float8 for 8-aligned frames
+void StereoSGMCL::clear(CLBuffer* buffer, size_t size){
+    int count = int(size / 32);
+    m_clear_buffer->SetArgs(buffer, count);
+    m_clear_buffer->Launch(0, GridDim((count + 256 - 1)/ 256), BlockDim(256));
+}
+
 void StereoSGMCL::mem_init(){
-    m_clear_buffer->SetArgs(d_left_disparity);
-    m_clear_buffer->Launch(0, GridDim(width_ * height_ * sizeof(uint16_t)/ 32/ 256),
-                                                                     BlockDim(256));
-    m_clear_buffer->SetArgs(d_right_disparity);
-    m_clear_buffer->Launch(0, GridDim(width_ * height_ * sizeof(uint16_t)/ 32/ 256),
-                                                                     BlockDim(256));
-    m_clear_buffer->SetArgs(d_scost);
-    m_clear_buffer->Launch(0, GridDim(width_ * height_ * sizeof(uint16_t) * disp_size_
-                                                          / 32/ 256),BlockDim(256));
+    clear(d_left_disparity, width_ * height_ * sizeof(uint16_t));
+    clear(d_right_disparity, width_ * height_ * sizeof(uint16_t));
 }
 
-void StereoSGMCL::matching_cost(){
-    m_matching_cost_kernel_128->Launch(0, GridDim(height_/2), BlockDim(128,2));
+void StereoSGMCL::matching_cost(const Window& window){
+    const int MCOST_TILE_W = 32, MCOST_TILE_H = 4;
+    int width = window.area.width, height = window.area.height;
+    int x_offset = window.area.x, y_offset = window.area.y;
+    m_matching_cost_kernel_128->SetArgs(d_left, d_right, d_matching_cost, width, height,
+                                        x_offset, y_offset, width_);
+    m_matching_cost_kernel_128->Launch(0, GridDim((width + MCOST_TILE_W - 1)/MCOST_TILE_W,
+                                                  (height + MCOST_TILE_H - 1)/MCOST_TILE_H),
+                                                  BlockDim(MCOST_TILE_W, MCOST_TILE_H));
 }
 
-void StereoSGMCL::scan_cost(){
+void StereoSGMCL::scan_cost(const Window& window){
     static const int PATHS_IN_BLOCK = 8;
-    const int obl_num_paths = width_ + height_ ;
+    int width = window.area.width, height = window.area.height;
+    const int obl_num_paths = width + height ;
+
+    clear(d_scost, sizeof(uint16_t) * width * height * disp_size_);
+    CLKernel* path_kernels[] = {
+        m_compute_stereo_horizontal_dir_kernel_0, m_compute_stereo_horizontal_dir_kernel_4,
+        m_compute_stereo_vertical_dir_kernel_2, m_compute_stereo_vertical_dir_kernel_6,
+        m_compute_stereo_oblique_dir_kernel_1, m_compute_stereo_oblique_dir_kernel_3,
+        m_compute_stereo_oblique_dir_kernel_5, m_compute_stereo_oblique_dir_kernel_7};
+    for(CLKernel* kernel : path_kernels)
+        kernel->SetArgs(d_matching_cost, d_scost, width, height);
 
     m_compute_stereo_horizontal_dir_kernel_0->Launch(0,
-    GridDim(height_ / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
+    GridDim(height / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
     m_compute_stereo_horizontal_dir_kernel_4->Launch(0,
-    GridDim(height_ / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
+    GridDim(height / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
     m_compute_stereo_vertical_dir_kernel_2->Launch(0,
-    GridDim(width_ / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
+    GridDim(width / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
     m_compute_stereo_vertical_dir_kernel_6->Launch(0,
-    GridDim(width_ / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
+    GridDim(width / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
 
     m_compute_stereo_oblique_dir_kernel_1->Launch(0,
     GridDim(obl_num_paths / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
@@ -459,11 +759,21 @@ void StereoSGMCL::scan_cost(){
     GridDim(obl_num_paths / PATHS_IN_BLOCK),BlockDim(32, PATHS_IN_BLOCK));
 }
 
-void StereoSGMCL::winner_takes_all(){
-    const int WTA_PIXEL_IN_BLOCK = 8;
-    m_winner_takes_all_kernel128->Launch(0,
-    GridDim(width_ / WTA_PIXEL_IN_BLOCK,1 * height_),
-    BlockDim(32, WTA_PIXEL_IN_BLOCK));
+void StereoSGMCL::winner_takes_all(const Window& window){
+    const int WTA_TILE_W = 64, WTA_THREADS_PER_PIXEL = 4;
+    int subpixel = subpixel_ ? 1 : 0;
+    int width = window.area.width, height = window.area.height;
+    int x_offset = window.area.x, y_offset = window.area.y;
+    for(const Rect& roi : window.rois){
+        //roi in window coordinates
+        int roi_x = roi.x - x_offset, roi_y = roi.y - y_offset, roi_width = roi.width;
+        m_winner_takes_all_kernel128->SetArgs(d_left_disparity, d_right_disparity, d_scost,
+                                              width, height, subpixel, roi_x, roi_y, roi_width,
+                                              x_offset, y_offset, width_);
+        m_winner_takes_all_kernel128->Launch(0,
+        GridDim((roi_width + WTA_TILE_W - 1) / WTA_TILE_W, roi.height),
+        BlockDim(WTA_THREADS_PER_PIXEL, WTA_TILE_W));
+    }
 }
 
 void StereoSGMCL::median(){
@@ -476,6 +786,12 @@ void StereoSGMCL::median(){
 
 }
 
+void StereoSGMCL::apply_mask(){
+    m_mask_disparity->SetArgs(d_tmp_left_disp, d_mask, width_, height_);
+    m_mask_disparity->Launch(0, GridDim((width_ + 16 - 1)/16, (height_ + 16 - 1)/16),
+                                                                BlockDim(16,16));
+}
+
 void StereoSGMCL::check_consistency_left(){
     m_check_consistency_left->Launch(0,GridDim((width_ + 16 - 1)/16,
                                               (height_ + 16 - 1)/16),BlockDim(16,16));
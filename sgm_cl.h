@@ -8,7 +8,9 @@
 
 #include <iostream>
 #include <cstdio>
+#include <cstdint>
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <string>
 #include <fstream>
@@ -28,6 +30,12 @@ struct GridDim {
     int x, y, z;
 };
 
+struct Rect {
+    Rect(int _x = 0, int _y = 0, int _width = 0, int _height = 0):
+                    x(_x), y(_y), width(_width), height(_height) {}
+    int x, y, width, height;
+};
+
 struct ArgumentPropereties
 {
     ArgumentPropereties(void* ptr = nullptr, size_t argsize = 0) :
@@ -52,6 +60,18 @@ enum SyncMode
     SYNC_MODE_BLOCKING = 1
 };
 
+// raw camera formats accepted by the preprocessing stage, all 8 bit per sample;
+// Bayer formats are named after the top-left 2x2 quad of the sensor
+enum InputFormat
+{
+    INPUT_FORMAT_GRAY8 = 0,
+    INPUT_FORMAT_BGR8 = 1,
+    INPUT_FORMAT_BAYER_RGGB8 = 2,
+    INPUT_FORMAT_BAYER_BGGR8 = 3,
+    INPUT_FORMAT_BAYER_GRBG8 = 4,
+    INPUT_FORMAT_BAYER_GBRG8 = 5
+};
+
 class CLContext {
 public:
     CLContext(int platform_id = 0, int device_id = 0, int num_streams = 1);
@@ -144,19 +164,64 @@ public:
     StereoSGMCL(int width, int height, int disp_size, const CLContext* ctx = nullptr);
     bool Init(const CLContext* ctx);
     void Run(void* left_img, void* right_img, void* output);
+    // sub-pixel disparities come out in fixed point with SUBPIXEL_SHIFT fractional
+    // bits, refined by a parabola fit in the WTA pass; 0 still marks invalid pixels
+    inline void SetSubpixel(bool enable) {subpixel_ = enable;}
+    // makes Run() take raw src_width x src_height frames in the given format, converted
+    // to gray and rectified on the device. Maps hold the source coordinates of every
+    // output pixel (cv::initUndistortRectifyMap with CV_32FC1), nullptr for identity;
+    // they are uploaded once in fixed point, so sources are limited to 4096x4096.
+    // Bayer frames are converted per 2x2 quad and sampled at quad centres, i.e. half
+    // a pixel up-left of the map position, so the output is not shifted.
+    // INPUT_FORMAT_GRAY8 at width x height without maps turns preprocessing off again
+    bool SetPreprocess(InputFormat format, int src_width, int src_height,
+                       const float* map_x_left = nullptr, const float* map_y_left = nullptr,
+                       const float* map_x_right = nullptr, const float* map_y_right = nullptr);
+    // restricts matching cost, aggregation and WTA to the given regions grown by
+    // margin pixels of path warm-up; regions share a window where that is cheaper,
+    // disparities outside them come out as 0 and an empty list restores full frame
+    // processing
+    bool SetROIs(const std::vector<Rect>& rois, int margin = DEFAULT_ROI_MARGIN);
+    // same for a width x height mask (non-zero = needed), covered by 16-row bands
+    // grouped into the windows of least total area; the output is also zeroed
+    // outside the mask, nullptr clears it. Both return false for a negative margin
+    bool SetMask(const uint8_t* mask, int margin = DEFAULT_ROI_MARGIN);
     ~StereoSGMCL();
 
+    static const int SUBPIXEL_SHIFT = 4;
+    static const int DEFAULT_ROI_MARGIN = 32;
+
 private:
+    // area is the processed part of the frame, rois (frame coordinates) the parts
+    // of it whose disparities are written
+    struct Window {
+        Rect area;
+        std::vector<Rect> rois;
+    };
+
     void initCL();
+    Window make_window(const std::vector<Rect>& rois, int margin) const;
+    void set_windows(const std::vector<Window>& windows);
+    void reserve_cost_volume(size_t num_pixels);
+    void clear(CLBuffer* buffer, size_t size);
+    void rectify();
     void census();
     void mem_init();
-    void matching_cost();
-    void scan_cost();
-    void winner_takes_all();
+    void matching_cost(const Window& window);
+    void scan_cost(const Window& window);
+    void winner_takes_all(const Window& window);
     void median();
+    void apply_mask();
     void check_consistency_left();
 private:
     int width_, height_, disp_size_;
+    bool subpixel_;
+    bool preprocess_;
+    InputFormat input_format_;
+    int src_width_, src_height_;
+    std::vector<Window> windows_;
+    size_t cost_capacity_;
+    bool masked_;
     const CLContext* context_;
     CLProgram* sgm_prog_;
 
@@ -171,6 +236,7 @@ private:
 //    CLKernel* aggre_cost_topright2downleft_kernel_;
 //    CLKernel* aggre_cost_downleft2topright_kernel_;
 //    CLKernel* aggre_cost_downright2topleft_kernel_;
+    CLKernel * m_rectify_kernel;
     CLKernel * m_census_kernel;
     CLKernel * m_matching_cost_kernel_128;
 
@@ -191,6 +257,8 @@ private:
 
     CLKernel * m_median_3x3;
 
+    CLKernel * m_mask_disparity;
+
     CLKernel * m_copy_u8_to_u16;
     CLKernel * m_clear_buffer;
 
@@ -199,6 +267,10 @@ private:
         *d_scost,* d_left_disparity,* d_right_disparity,
         *d_tmp_left_disp, *d_tmp_right_disp;
 
+    CLBuffer * d_raw_left, *d_raw_right, *d_map_left, *d_map_right;
+
+    CLBuffer * d_mask;
+
 };
 
 #include "sgm_cl.inl"
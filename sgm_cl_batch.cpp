@@ -0,0 +1,398 @@
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "sgm_cl.h"
+
+/**
+ * Headless batch front-end: runs StereoSGMCL over a whole recorded sequence,
+ * either a pair of directories holding left/right images (paired by sorted
+ * file name) or a raw frame dump (8-bit grayscale, left then right, frames
+ * back to back). A producer thread decodes/prefetches frames into a bounded
+ * queue while the device works on the current one, and a writer thread
+ * encodes the disparity maps from a second queue.
+ */
+
+enum OutputFormat
+{
+    OUTPUT_FORMAT_PNG = 0,
+    OUTPUT_FORMAT_RAW = 1
+};
+
+struct Frame {
+    int index;
+    cv::Mat left, right;
+};
+
+struct Disparity {
+    int index;
+    cv::Mat disp;
+};
+
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t depth) : depth_(depth), closed_(false) {}
+
+    //returns false if the queue was closed, the item is dropped then
+    bool Push(T&& item){
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]{return items_.size() < depth_ || closed_;});
+        if(closed_)
+            return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    //returns false once the queue is closed and drained
+    bool Pop(T& item){
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]{return !items_.empty() || closed_;});
+        if(items_.empty())
+            return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void Close(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+private:
+    size_t depth_;
+    bool closed_;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_full_, not_empty_;
+};
+
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+    virtual bool Next(Frame& frame) = 0;
+    int Width() const {return width_;}
+    int Height() const {return height_;}
+    size_t Count() const {return count_;}
+
+protected:
+    int width_ = 0, height_ = 0;
+    size_t count_ = 0;
+};
+
+class DirectorySource : public FrameSource {
+public:
+    DirectorySource(const std::string& left_dir, const std::string& right_dir){
+        cv::glob(left_dir, left_files_, false);
+        cv::glob(right_dir, right_files_, false);
+        if(left_files_.empty() || left_files_.size() != right_files_.size()){
+            printf("Mismatched stereo directories: %zu left, %zu right images!\n",
+                   left_files_.size(), right_files_.size());
+            exit(EXIT_FAILURE);
+        }
+        count_ = left_files_.size();
+        cv::Mat first = cv::imread(left_files_[0], cv::IMREAD_GRAYSCALE);
+        if(first.empty()){
+            printf("Cannot read %s!\n", left_files_[0].c_str());
+            exit(EXIT_FAILURE);
+        }
+        width_ = first.cols;
+        height_ = first.rows;
+    }
+
+    bool Next(Frame& frame) override{
+        if(next_ >= count_)
+            return false;
+        frame.index = int(next_);
+        frame.left = cv::imread(left_files_[next_], cv::IMREAD_GRAYSCALE);
+        frame.right = cv::imread(right_files_[next_], cv::IMREAD_GRAYSCALE);
+        if(!Valid(frame.left) || !Valid(frame.right)){
+            printf("Skipping unreadable or mis-sized pair %s / %s\n",
+                   left_files_[next_].c_str(), right_files_[next_].c_str());
+            ++next_;
+            return Next(frame);
+        }
+        ++next_;
+        return true;
+    }
+
+private:
+    bool Valid(const cv::Mat& img) const{
+        return !img.empty() && img.cols == width_ && img.rows == height_;
+    }
+
+    std::vector<cv::String> left_files_, right_files_;
+    size_t next_ = 0;
+};
+
+class DumpSource : public FrameSource {
+public:
+    DumpSource(const std::string& path, int width, int height){
+        width_ = width;
+        height_ = height;
+        frame_bytes_ = size_t(width) * height * 2;
+        fd_ = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if(fd_ < 0 || fstat(fd_, &st) != 0){
+            printf("Cannot open %s!\n", path.c_str());
+            exit(EXIT_FAILURE);
+        }
+        size_ = size_t(st.st_size);
+        count_ = size_ / frame_bytes_;
+        if(count_ == 0){
+            printf("%s holds no complete %dx%d stereo frame!\n", path.c_str(), width, height);
+            exit(EXIT_FAILURE);
+        }
+        if(size_ % frame_bytes_ != 0)
+            printf("Ignoring %zu trailing bytes in %s\n", size_ % frame_bytes_, path.c_str());
+        data_ = static_cast<uchar*>(mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0));
+        if(data_ == MAP_FAILED){
+            printf("Cannot map %s: %s\n", path.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+
+    ~DumpSource(){
+        munmap(data_, size_);
+        close(fd_);
+    }
+
+    bool Next(Frame& frame) override{
+        if(next_ >= count_)
+            return false;
+        uchar* ptr = data_ + next_ * frame_bytes_;
+        //fault the pages in here, so the consumer never stalls on disk
+        volatile uchar sink = 0;
+        for(size_t off = 0; off < frame_bytes_; off += 4096)
+            sink ^= ptr[off];
+        (void)sink;
+        if(next_ + 1 < count_){
+            uchar* ahead = ptr + frame_bytes_;
+            size_t misalign = size_t(ahead) & 4095;
+            madvise(ahead - misalign, frame_bytes_ + misalign, MADV_WILLNEED);
+        }
+
+        frame.index = int(next_);
+        frame.left = cv::Mat(height_, width_, CV_8U, ptr);
+        frame.right = cv::Mat(height_, width_, CV_8U, ptr + frame_bytes_ / 2);
+        ++next_;
+        return true;
+    }
+
+private:
+    int fd_ = -1;
+    uchar* data_ = nullptr;
+    size_t size_ = 0, frame_bytes_ = 0, next_ = 0;
+};
+
+static void PrintUsage(){
+    std::cout << "usage: sgm_cl_batch [options] <left_dir> <right_dir>\n"
+              << "       sgm_cl_batch [options] -r <width>x<height> <dump_file>\n"
+              << "options:\n"
+              << "  -o <dir>      output directory (default: ./)\n"
+              << "  -f png|raw    16-bit png per frame, or one raw uint16 dump (default: png)\n"
+              << "  -n            skip writing disparity maps (throughput run)\n"
+              << "  -p            sub-pixel disparity, fixed point with 4 fractional bits\n"
+              << "  -q <depth>    prefetch and write queue depth (default: 4)\n";
+}
+
+int main(int argc, char const* const* argv)
+{
+    std::string out_dir = "./";
+    std::vector<std::string> positional;
+    OutputFormat out_format = OUTPUT_FORMAT_PNG;
+    bool write_output = true, subpixel = false;
+    int queue_depth = 4, dump_width = 0, dump_height = 0;
+
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if(arg == "-o" && has_value){
+            out_dir = argv[++i];
+        }else if(arg == "-f" && has_value){
+            std::string fmt = argv[++i];
+            if(fmt != "png" && fmt != "raw"){
+                PrintUsage();
+                return EXIT_FAILURE;
+            }
+            out_format = fmt == "raw" ? OUTPUT_FORMAT_RAW : OUTPUT_FORMAT_PNG;
+        }else if(arg == "-n"){
+            write_output = false;
+        }else if(arg == "-p"){
+            subpixel = true;
+        }else if(arg == "-q" && has_value){
+            queue_depth = std::max(1, atoi(argv[++i]));
+        }else if(arg == "-r" && has_value){
+            if(sscanf(argv[++i], "%dx%d", &dump_width, &dump_height) != 2 ||
+               dump_width <= 0 || dump_height <= 0){
+                PrintUsage();
+                return EXIT_FAILURE;
+            }
+        }else{
+            positional.push_back(arg);
+        }
+    }
+
+    FrameSource* source = nullptr;
+    if(dump_width > 0 && positional.size() == 1){
+        source = new DumpSource(positional[0], dump_width, dump_height);
+    }else if(dump_width == 0 && positional.size() == 2){
+        source = new DirectorySource(positional[0], positional[1]);
+    }else{
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+
+    int width = source->Width();
+    int height = source->Height();
+    FILE* raw_out = nullptr;
+    if(write_output){
+        if(mkdir(out_dir.c_str(), 0755) != 0 && errno != EEXIST){
+            printf("Cannot create output directory %s!\n", out_dir.c_str());
+            return EXIT_FAILURE;
+        }
+        if(out_format == OUTPUT_FORMAT_RAW){
+            std::string raw_path = out_dir + "/disparity.raw";
+            raw_out = fopen(raw_path.c_str(), "wb");
+            if(!raw_out){
+                printf("Cannot open %s!\n", raw_path.c_str());
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    sgm_cl::CLContext* context = new sgm_cl::CLContext;
+    std::cout<<context->CLInfo()<<std::endl;
+    printf("Processing %zu frames of %dx%d\n", source->Count(), width, height);
+
+    bool write_failed_total = false;
+    {
+        //the kernels are compiled for DISP_SIZE 128 only
+        sgm_cl::StereoSGMCL ssgm(width, height, 128, context);
+        ssgm.SetSubpixel(subpixel);
+        BoundedQueue<Frame> queue(queue_depth);
+        std::thread producer([&]{
+            Frame frame;
+            while(source->Next(frame) && queue.Push(std::move(frame)))
+                ;
+            queue.Close();
+        });
+
+        //encoding and disk I/O stay off the thread that feeds the device
+        BoundedQueue<Disparity> write_queue(queue_depth);
+        std::atomic<bool> write_failed(false);
+        std::thread writer([&]{
+            //frames skipped by the source get a zero map, so frame i of the
+            //raw dump always sits at offset i * width * height * 2
+            const size_t num_pixels = size_t(width) * height;
+            cv::Mat zero_disp;
+            int next_raw = 0;
+            auto write_raw = [&](int index, const cv::Mat& disp){
+                if(fwrite(disp.data, sizeof(uint16_t), num_pixels, raw_out) != num_pixels){
+                    printf("Failed to write disparity of frame %d: %s\n", index, strerror(errno));
+                    write_failed = true;
+                }
+                ++next_raw;
+            };
+            auto pad_raw = [&](int index){
+                if(next_raw < index && zero_disp.empty())
+                    zero_disp = cv::Mat::zeros(height, width, CV_16U);
+                while(!write_failed && next_raw < index)
+                    write_raw(next_raw, zero_disp);
+            };
+
+            Disparity item;
+            while(write_queue.Pop(item)){
+                if(write_failed)
+                    continue;
+                if(out_format == OUTPUT_FORMAT_RAW){
+                    pad_raw(item.index);
+                    if(!write_failed)
+                        write_raw(item.index, item.disp);
+                }else{
+                    char name[32];
+                    snprintf(name, sizeof(name), "/%06d.png", item.index);
+                    if(!cv::imwrite(out_dir + name, item.disp)){
+                        printf("Failed to write %s%s\n", out_dir.c_str(), name);
+                        write_failed = true;
+                    }
+                }
+            }
+            if(raw_out && !write_failed)
+                pad_raw(int(source->Count()));
+        });
+
+        Frame frame;
+        int num_frames = 0;
+        double run_ms = 0.0;
+        auto st = std::chrono::steady_clock::now();
+        auto warm = st;
+        //a fresh map per frame only when the writer holds on to it
+        cv::Mat scratch_disp;
+        if(!write_output)
+            scratch_disp = cv::Mat(height, width, CV_16U);
+        while(!write_failed && queue.Pop(frame)){
+            Disparity out{frame.index, write_output ? cv::Mat(height, width, CV_16U) : scratch_disp};
+            auto run_st = std::chrono::steady_clock::now();
+            ssgm.Run(frame.left.data, frame.right.data, out.disp.data);
+            auto run_ed = std::chrono::steady_clock::now();
+            run_ms += std::chrono::duration<double, std::milli>(run_ed - run_st).count();
+
+            if(write_output)
+                write_queue.Push(std::move(out));
+            if(++num_frames == 1)
+                warm = std::chrono::steady_clock::now();
+            if(num_frames % 100 == 0)
+                printf("%d frames done\n", num_frames);
+        }
+        //stops the producer early if writing failed
+        queue.Close();
+        write_queue.Close();
+        writer.join();
+        auto ed = std::chrono::steady_clock::now();
+        producer.join();
+
+        double total_s = std::chrono::duration<double>(ed - st).count();
+        //the first frame pays for lazy driver initialization, keep it out of the rate
+        double sustained_s = std::chrono::duration<double>(ed - warm).count();
+        double fps = num_frames > 1 && sustained_s > 0.0 ? (num_frames - 1) / sustained_s
+                                                         : num_frames / total_s;
+        printf("Processed %d frames in %.3lf s\n", num_frames, total_s);
+        printf("Run average: %.3lf ms, sustained throughput: %.2lf fps\n",
+               num_frames > 0 ? run_ms / num_frames : 0.0, fps);
+        write_failed_total = write_failed;
+    }
+
+    if(raw_out && fclose(raw_out) != 0){
+        printf("Failed to close the raw disparity dump: %s\n", strerror(errno));
+        write_failed_total = true;
+    }
+    delete source;
+    delete context;
+    return write_failed_total ? EXIT_FAILURE : 0;
+}